@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstddef>
+#include <utility>
+
+#include "intrusive_ptr.h"
+
+namespace c10 {
+namespace intrusive_ptr {
+inline namespace C10_INTRUSIVE_PTR_ABI_NAMESPACE {
+
+/**
+ * Like shared_ptr's aliasing constructor: points at T (a member, a sub-buffer...) but owns a strong ref
+ * on the parent TOwner, so the whole parent stays alive while any of these exist.
+ * e.g. one weight inside a packed parameter blob, one head inside a KV block.
+ * No allocation and no second refcount, it's just the owner pointer + the interior pointer,
+ * and copies bump the owner's combined_refcount_ exactly like intrusive_ptr<TOwner> copies would.
+ */
+template <class T, class TOwner>
+class aliasing_intrusive_ptr final {
+    using owner_ptr = intrusive_ptr<TOwner>;
+
+    private:
+        TOwner* owner_;
+        T* ptr_;
+
+        void retain_() {
+            if (owner_ != nullptr) {
+                owner_ptr::retain_n_(owner_, 1);
+            }
+        }
+
+        void reset_() {
+            if (owner_ != nullptr) {
+                owner_ptr::release_n_(owner_, 1);
+            }
+        }
+
+    public:
+        using element_type = T;
+
+        aliasing_intrusive_ptr() noexcept : owner_(nullptr), ptr_(nullptr) {}
+
+        aliasing_intrusive_ptr(std::nullptr_t) noexcept : aliasing_intrusive_ptr() {}
+
+        // Shares the caller's ref on owner. ptr should point into owner, nothing checks that
+        aliasing_intrusive_ptr(const owner_ptr& owner, T* ptr) noexcept : owner_(owner.get()), ptr_(ptr) {
+            retain_();
+        }
+
+        // Takes the caller's ref on owner, no refcount traffic
+        aliasing_intrusive_ptr(owner_ptr&& owner, T* ptr) noexcept : owner_(owner.release()), ptr_(ptr) {}
+
+        // Another view into the same parent, e.g. a sub-slice of a sub-buffer
+        template <class T2>
+        aliasing_intrusive_ptr(const aliasing_intrusive_ptr<T2, TOwner>& rhs, T* ptr) noexcept : owner_(rhs.owner()), ptr_(ptr) {
+            retain_();
+        }
+
+        aliasing_intrusive_ptr(const aliasing_intrusive_ptr& rhs) noexcept : owner_(rhs.owner_), ptr_(rhs.ptr_) {
+            retain_();
+        }
+
+        // steal the ref
+        aliasing_intrusive_ptr(aliasing_intrusive_ptr&& rhs) noexcept : owner_(rhs.owner_), ptr_(rhs.ptr_) {
+            rhs.owner_ = nullptr;
+            rhs.ptr_ = nullptr;
+        }
+
+        ~aliasing_intrusive_ptr() noexcept {
+            reset_();
+        }
+
+        aliasing_intrusive_ptr& operator=(const aliasing_intrusive_ptr& rhs) & noexcept {
+            aliasing_intrusive_ptr tmp = rhs;
+            swap(tmp);
+            return *this;
+            // tmp drops whatever we had before
+        }
+
+        aliasing_intrusive_ptr& operator=(aliasing_intrusive_ptr&& rhs) & noexcept {
+            aliasing_intrusive_ptr tmp = std::move(rhs);
+            swap(tmp);
+            return *this;
+        }
+
+        T* get() const noexcept {
+            return ptr_;
+        }
+
+        T* operator->() const noexcept {
+            return ptr_;
+        }
+
+        T& operator*() const noexcept {
+            return *ptr_;
+        }
+
+        // Borrowed, the parent we're keeping alive
+        TOwner* owner() const noexcept {
+            return owner_;
+        }
+
+        // Back to a plain handle on the parent, one more strong ref
+        owner_ptr owner_handle() const noexcept {
+            if (owner_ != nullptr) {
+                owner_ptr::retain_n_(owner_, 1);
+            }
+            return owner_ptr(owner_, raw::DontIncreaseRefCount{});
+        }
+
+        void swap(aliasing_intrusive_ptr& rhs) noexcept {
+            std::swap(owner_, rhs.owner_);
+            std::swap(ptr_, rhs.ptr_);
+        }
+};
+
+template <class T, class TOwner>
+inline aliasing_intrusive_ptr<T, TOwner> make_aliasing_intrusive(const intrusive_ptr<TOwner>& owner, T* ptr) {
+    return aliasing_intrusive_ptr<T, TOwner>(owner, ptr);
+}
+
+template <class T, class TOwner>
+inline aliasing_intrusive_ptr<T, TOwner> make_aliasing_intrusive(intrusive_ptr<TOwner>&& owner, T* ptr) {
+    return aliasing_intrusive_ptr<T, TOwner>(std::move(owner), ptr);
+}
+
+} // inline namespace C10_INTRUSIVE_PTR_ABI_NAMESPACE
+} // namespace intrusive_ptr
+} // namespace c10
@@ -0,0 +1,263 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+
+#include "intrusive_ptr.h"
+
+namespace c10 {
+namespace intrusive_ptr {
+inline namespace C10_INTRUSIVE_PTR_ABI_NAMESPACE {
+
+/**
+ * Typed arena for intrusive_ptr_targets that are referenced by 32-bit index instead of pointer.
+ * Objects live in chunks of about kChunkBytes that never move, so an index stays valid for the object's lifetime.
+ * Chunks are found through a two-level table (a fixed root of leaves, each leaf a block of chunk pointers),
+ * leaves and chunks are only allocated once an index in them is handed out. A new arena costs the 8KB root.
+ * Index 0 is never handed out and means null.
+ * Allocating/freeing a slot takes a mutex, looking an index up is three loads and no lock.
+ */
+template <class TTarget>
+class intrusive_arena final {
+    // free slots reuse the object's storage for the free list link
+    union slot {
+        alignas(TTarget) unsigned char storage[sizeof(TTarget)];
+        uint32_t next_free;
+    };
+
+    static constexpr size_t kChunkBytes = 64 * 1024;
+
+    // as many slots as fit in kChunkBytes, rounded down to a power of two. 12 bits at most so
+    // root + leaf + chunk bits never go past 32
+    static constexpr uint32_t chunk_bits_() {
+        uint32_t bits = 0;
+        while (bits < 12 && (sizeof(slot) << (bits + 1)) <= kChunkBytes) {
+            ++bits;
+        }
+        return bits;
+    }
+
+    static constexpr uint32_t kChunkBits = chunk_bits_();
+    static constexpr uint32_t kChunkSize = (uint32_t(1) << kChunkBits);
+    static constexpr uint32_t kLeafBits = 10;
+    static constexpr uint32_t kLeafSize = (uint32_t(1) << kLeafBits);
+    static constexpr uint32_t kRootSize = 1024;
+    // big targets get fewer indices than 2^32, still far more objects than fit in memory
+    static constexpr uint64_t kMaxSlots = uint64_t(kRootSize) << (kLeafBits + kChunkBits);
+
+    struct leaf {
+        std::atomic<slot*> chunks[kLeafSize] = {};
+    };
+
+    private:
+        std::atomic<leaf*> root_[kRootSize] = {};
+        std::mutex mutex_;
+        uint64_t next_index_ = 1; // 0 is null
+        uint32_t free_head_ = 0;
+
+        slot* slot_at_(uint32_t index) const noexcept {
+            leaf* l = root_[index >> (kLeafBits + kChunkBits)].load(std::memory_order_acquire);
+            slot* chunk = l->chunks[(index >> kChunkBits) & (kLeafSize - 1)].load(std::memory_order_acquire);
+            return &chunk[index & (kChunkSize - 1)];
+        }
+
+        uint32_t allocate_() {
+            std::lock_guard<std::mutex> guard(mutex_);
+            if (free_head_ != 0) {
+                uint32_t index = free_head_;
+                free_head_ = slot_at_(index)->next_free;
+                return index;
+            }
+            if (next_index_ >= kMaxSlots) {
+                throw std::bad_alloc(); // every index is in use
+            }
+            uint32_t index = static_cast<uint32_t>(next_index_);
+            // neither leaves nor chunks are freed while the arena lives, indices into them have to stay valid
+            auto& root_entry = root_[index >> (kLeafBits + kChunkBits)];
+            leaf* l = root_entry.load(std::memory_order_relaxed);
+            if (l == nullptr) {
+                l = new leaf();
+                root_entry.store(l, std::memory_order_release);
+            }
+            auto& chunk = l->chunks[(index >> kChunkBits) & (kLeafSize - 1)];
+            if (chunk.load(std::memory_order_relaxed) == nullptr) {
+                chunk.store(new slot[kChunkSize], std::memory_order_release);
+            }
+            ++next_index_;
+            return index;
+        }
+
+        void deallocate_(uint32_t index) noexcept {
+            std::lock_guard<std::mutex> guard(mutex_);
+            slot_at_(index)->next_free = free_head_;
+            free_head_ = index;
+        }
+
+    public:
+        intrusive_arena() noexcept = default;
+
+        intrusive_arena(const intrusive_arena&) = delete;
+        intrusive_arena& operator=(const intrusive_arena&) = delete;
+
+        // Frees the memory, objects still in the arena are not destroyed
+        ~intrusive_arena() noexcept {
+            for (auto& root_entry : root_) {
+                leaf* l = root_entry.load(std::memory_order_relaxed);
+                if (l == nullptr) {
+                    continue;
+                }
+                for (auto& chunk : l->chunks) {
+                    delete[] chunk.load(std::memory_order_relaxed);
+                }
+                delete l;
+            }
+        }
+
+        // One arena per type so a handle only has to store the index.
+        // Leaked on purpose, handles in other statics may still be released during shutdown
+        static intrusive_arena& global() {
+            static intrusive_arena* arena = new intrusive_arena();
+            return *arena;
+        }
+
+        TTarget* get(uint32_t index) const noexcept {
+            return index == 0 ? nullptr : at(index);
+        }
+
+        // No null check, index has to be one create() returned
+        TTarget* at(uint32_t index) const noexcept {
+            return std::launder(reinterpret_cast<TTarget*>(slot_at_(index)->storage));
+        }
+
+        template <class... Args>
+        uint32_t create(Args&&... args) {
+            uint32_t index = allocate_();
+            try {
+                new (slot_at_(index)->storage) TTarget(std::forward<Args>(args)...);
+            } catch (...) {
+                deallocate_(index);
+                throw;
+            }
+            return index;
+        }
+
+        // Destruct in place and put the slot back on the free list
+        void destroy(uint32_t index) noexcept {
+            at(index)->~TTarget();
+            deallocate_(index);
+        }
+};
+
+/**
+ * 4 byte strong handle to an intrusive_ptr_target that lives in intrusive_arena<TTarget>::global().
+ * Same refcounting as intrusive_ptr (it goes through the same retain_n_/drop_refs_, so immortal,
+ * weak-free and sharded targets behave the same), only the destroy step returns the slot to the arena
+ * instead of calling delete. Use it for pointer-heavy graphs where half the node is pointers.
+ * Objects made this way can't be handed to an intrusive_ptr, they weren't allocated with new.
+ */
+template <class TTarget>
+class compact_intrusive_ptr final {
+    using arena_type = intrusive_arena<TTarget>;
+    using refcount_ops = intrusive_ptr<TTarget>;
+
+    private:
+        uint32_t index_;
+
+        void retain_() {
+            if (index_ != 0) {
+                refcount_ops::retain_n_(get(), 1);
+            }
+        }
+
+        void reset_() {
+            if (index_ != 0) {
+                if (refcount_ops::drop_refs_(get(), 1)) {
+                    arena_type::global().destroy(index_);
+#ifdef C10_INTRUSIVE_PTR_METRICS
+                    detail::count_live_targets(-1);
+#endif
+                }
+                index_ = 0;
+            }
+        }
+
+        explicit compact_intrusive_ptr(uint32_t index) noexcept : index_(index) {}
+
+    public:
+        using element_type = TTarget;
+
+        compact_intrusive_ptr() noexcept : index_(0) {}
+
+        compact_intrusive_ptr(std::nullptr_t) noexcept : index_(0) {}
+
+        compact_intrusive_ptr(const compact_intrusive_ptr& rhs) noexcept : index_(rhs.index_) {
+            retain_();
+        }
+
+        // steal the ref
+        compact_intrusive_ptr(compact_intrusive_ptr&& rhs) noexcept : index_(rhs.index_) {
+            rhs.index_ = 0;
+        }
+
+        ~compact_intrusive_ptr() noexcept {
+            reset_();
+        }
+
+        compact_intrusive_ptr& operator=(const compact_intrusive_ptr& rhs) & noexcept {
+            compact_intrusive_ptr tmp = rhs;
+            std::swap(index_, tmp.index_);
+            return *this;
+            // tmp drops whatever we had before
+        }
+
+        compact_intrusive_ptr& operator=(compact_intrusive_ptr&& rhs) & noexcept {
+            compact_intrusive_ptr tmp = std::move(rhs);
+            std::swap(index_, tmp.index_);
+            return *this;
+        }
+
+        template <class... Args>
+        static compact_intrusive_ptr make(Args&&... args) {
+            // checked here rather than on the class so graph nodes can hold handles to their own type
+            static_assert(std::is_base_of_v<intrusive_ptr_target, TTarget>, "TTarget needs to be an intrusive_ptr_target");
+            uint32_t index = arena_type::global().create(std::forward<Args>(args)...);
+            // initialize with 1 weak and 1 strong ref, same as intrusive_ptr
+            arena_type::global().at(index)->combined_refcount_.store(detail::kUniqueRef, std::memory_order_relaxed);
+#ifdef C10_INTRUSIVE_PTR_METRICS
+            detail::count_live_targets(1);
+#endif
+            return compact_intrusive_ptr(index);
+        }
+
+        TTarget* get() const noexcept {
+            return arena_type::global().get(index_);
+        }
+
+        TTarget* operator->() const noexcept {
+            return get();
+        }
+
+        // the arena index, stable for the object's lifetime
+        uint32_t index() const noexcept {
+            return index_;
+        }
+
+        void swap(compact_intrusive_ptr& rhs) noexcept {
+            std::swap(index_, rhs.index_);
+        }
+};
+
+static_assert(sizeof(compact_intrusive_ptr<intrusive_ptr_target>) == 4);
+
+template <class TTarget, class... Args>
+inline compact_intrusive_ptr<TTarget> make_compact_intrusive(Args&&... args) {
+    return compact_intrusive_ptr<TTarget>::make(std::forward<Args>(args)...);
+}
+
+} // inline namespace C10_INTRUSIVE_PTR_ABI_NAMESPACE
+} // namespace intrusive_ptr
+} // namespace c10
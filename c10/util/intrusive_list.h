@@ -0,0 +1,147 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <type_traits>
+
+#include "intrusive_ptr.h"
+
+namespace c10 {
+namespace intrusive_ptr {
+inline namespace C10_INTRUSIVE_PTR_ABI_NAMESPACE {
+
+/**
+ * Embed this in an intrusive_ptr_target subclass so it can sit in an intrusive_list
+ * e.g. struct Task : intrusive_ptr_target, intrusive_list_hook {...}
+ * The links live inside the object, so pushing never allocates a wrapper node.
+ * An object can be in at most one list at a time.
+ */
+class intrusive_list_hook {
+    intrusive_list_hook* prev_ = nullptr;
+    intrusive_list_hook* next_ = nullptr;
+
+    template <class T, class N>
+    friend class intrusive_list;
+
+    public:
+        constexpr intrusive_list_hook() noexcept = default;
+
+        // same idea as intrusive_ptr_target, copying an object doesn't copy its membership
+        intrusive_list_hook(const intrusive_list_hook&) noexcept : intrusive_list_hook() {}
+
+        intrusive_list_hook& operator=(const intrusive_list_hook&) noexcept {
+            return *this;
+        }
+
+        bool is_linked() const noexcept {
+            return next_ != nullptr;
+        }
+};
+
+/**
+ * Doubly linked list of intrusive_ptr_targets. The list holds one strong ref per element,
+ * taken over from the intrusive_ptr that was pushed in, and gives it back on pop/erase.
+ * Not thread-safe, see intrusive_mpsc_queue for the concurrent version.
+ */
+template <class TTarget, class NullType=detail::intrusive_target_default_null_type<TTarget>>
+class intrusive_list final {
+    static_assert(std::is_base_of_v<intrusive_list_hook, TTarget>, "TTarget needs to embed an intrusive_list_hook");
+
+    using ptr_type = intrusive_ptr<TTarget, NullType>;
+
+    private:
+        intrusive_list_hook head_; // sentinel, the list is circular through it
+        size_t size_ = 0;
+
+        static TTarget* to_target(intrusive_list_hook* hook) noexcept {
+            return static_cast<TTarget*>(hook);
+        }
+
+        void link_before_(intrusive_list_hook* pos, TTarget* target) noexcept {
+            intrusive_list_hook* node = target;
+            assert(!node->is_linked() && "element is already in a list");
+            node->next_ = pos;
+            node->prev_ = pos->prev_;
+            pos->prev_->next_ = node;
+            pos->prev_ = node;
+            ++size_;
+        }
+
+        ptr_type unlink_(intrusive_list_hook* node) noexcept {
+            node->prev_->next_ = node->next_;
+            node->next_->prev_ = node->prev_;
+            node->prev_ = nullptr;
+            node->next_ = nullptr;
+            --size_;
+            return ptr_type::reclaim(to_target(node)); // hand the list's strong ref back to the caller
+        }
+
+    public:
+        intrusive_list() noexcept {
+            head_.prev_ = &head_;
+            head_.next_ = &head_;
+        }
+
+        // the list owns refs, copying it would need to retain every element
+        intrusive_list(const intrusive_list&) = delete;
+        intrusive_list& operator=(const intrusive_list&) = delete;
+
+        ~intrusive_list() noexcept {
+            clear();
+        }
+
+        bool empty() const noexcept {
+            return size_ == 0;
+        }
+
+        size_t size() const noexcept {
+            return size_;
+        }
+
+        // Borrowed pointers, the list keeps the ref
+        TTarget* front() const noexcept {
+            return empty() ? NullType::singleton() : to_target(head_.next_);
+        }
+
+        TTarget* back() const noexcept {
+            return empty() ? NullType::singleton() : to_target(head_.prev_);
+        }
+
+        // Take the ref from the caller, no refcount traffic and no allocation
+        void push_back(ptr_type ptr) noexcept {
+            if (ptr.get() != NullType::singleton()) {
+                link_before_(&head_, ptr.release());
+            }
+        }
+
+        void push_front(ptr_type ptr) noexcept {
+            if (ptr.get() != NullType::singleton()) {
+                link_before_(head_.next_, ptr.release());
+            }
+        }
+
+        // Returns a null ptr when the list is empty
+        ptr_type pop_front() noexcept {
+            return empty() ? ptr_type() : unlink_(head_.next_);
+        }
+
+        ptr_type pop_back() noexcept {
+            return empty() ? ptr_type() : unlink_(head_.prev_);
+        }
+
+        // target has to be in this list, O(1) since the links are in the object
+        ptr_type erase(TTarget* target) noexcept {
+            assert(static_cast<intrusive_list_hook*>(target)->is_linked());
+            return unlink_(target);
+        }
+
+        void clear() noexcept {
+            while (!empty()) {
+                pop_front(); // dropping the returned ptr releases the ref
+            }
+        }
+};
+
+} // inline namespace C10_INTRUSIVE_PTR_ABI_NAMESPACE
+} // namespace intrusive_ptr
+} // namespace c10
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+
+#include "intrusive_ptr.h"
+
+namespace c10 {
+namespace intrusive_ptr {
+inline namespace C10_INTRUSIVE_PTR_ABI_NAMESPACE {
+
+/**
+ * Vyukov's bounded multi-producer multi-consumer ring buffer, specialized for intrusive_ptr.
+ * Cells store the raw target pointer: try_push() moves the caller's strong ref in with release()
+ * and try_pop() adopts it back with DontIncreaseRefCount, so a handoff never touches
+ * combined_refcount_. Unlike intrusive_mpsc_queue the target doesn't need a hook.
+ */
+template <class TTarget, class NullType=detail::intrusive_target_default_null_type<TTarget>>
+class intrusive_mpmc_queue final {
+    using ptr_type = intrusive_ptr<TTarget, NullType>;
+
+    private:
+        struct cell {
+            // sequence == pos means free for the producer at pos, pos + 1 means full for the consumer at pos
+            std::atomic<size_t> sequence;
+            TTarget* target;
+        };
+
+        std::unique_ptr<cell[]> cells_;
+        const size_t mask_;
+        // each position counter gets its own cache line so producers and consumers don't false share
+        alignas(64) std::atomic<size_t> enqueue_pos_;
+        alignas(64) std::atomic<size_t> dequeue_pos_;
+
+        // runs before mask_ is computed, a bad capacity would otherwise index out of bounds
+        static cell* checked_cells_(size_t capacity) {
+            if (capacity < 2 || (capacity & (capacity - 1)) != 0) {
+                throw std::invalid_argument("intrusive_mpmc_queue capacity must be a power of two >= 2");
+            }
+            return new cell[capacity];
+        }
+
+    public:
+        // capacity has to be a power of two (>= 2) so wrapping is a mask, throws std::invalid_argument otherwise
+        explicit intrusive_mpmc_queue(size_t capacity)
+            : cells_(checked_cells_(capacity)), mask_(capacity - 1), enqueue_pos_(0), dequeue_pos_(0) {
+            for (size_t i = 0; i < capacity; ++i) {
+                cells_[i].sequence.store(i, std::memory_order_relaxed);
+                cells_[i].target = NullType::singleton();
+            }
+        }
+
+        intrusive_mpmc_queue(const intrusive_mpmc_queue&) = delete;
+        intrusive_mpmc_queue& operator=(const intrusive_mpmc_queue&) = delete;
+
+        // drop whatever refs are still queued, no other thread may be using the queue by now
+        ~intrusive_mpmc_queue() noexcept {
+            while (try_pop().get() != NullType::singleton()) {}
+        }
+
+        size_t capacity() const noexcept {
+            return mask_ + 1;
+        }
+
+        // Racy snapshot for monitoring (e.g. a queue depth gauge), don't use it for control flow
+        size_t size_approx() const noexcept {
+            size_t enqueued = enqueue_pos_.load(std::memory_order_relaxed);
+            size_t dequeued = dequeue_pos_.load(std::memory_order_relaxed);
+            return enqueued > dequeued ? enqueued - dequeued : 0;
+        }
+
+        /**
+         * Returns false when the queue is full, ptr is left untouched in that case so the caller
+         * can retry or back off. On success ptr is null afterwards.
+         * A null ptr is never queued (try_pop() uses null for "empty"), it's skipped and counts as pushed.
+         */
+        bool try_push(ptr_type& ptr) noexcept {
+            if (ptr.get() == NullType::singleton()) {
+                return true;
+            }
+            cell* c;
+            size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+            for (;;) {
+                c = &cells_[pos & mask_];
+                size_t seq = c->sequence.load(std::memory_order_acquire);
+                intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+                if (diff == 0) {
+                    // cell is free for this lap, claim the position
+                    if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                } else if (diff < 0) {
+                    return false; // consumer hasn't freed this cell yet from the last lap
+                } else {
+                    pos = enqueue_pos_.load(std::memory_order_relaxed); // another producer got it
+                }
+            }
+            c->target = ptr.release();
+            c->sequence.store(pos + 1, std::memory_order_release); // publish to consumers
+            return true;
+        }
+
+        bool try_push(ptr_type&& ptr) noexcept {
+            return try_push(ptr);
+        }
+
+        // Returns a null ptr when the queue is empty
+        ptr_type try_pop() noexcept {
+            cell* c;
+            size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+            for (;;) {
+                c = &cells_[pos & mask_];
+                size_t seq = c->sequence.load(std::memory_order_acquire);
+                intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+                if (diff == 0) {
+                    if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                } else if (diff < 0) {
+                    return ptr_type(); // nothing published here yet
+                } else {
+                    pos = dequeue_pos_.load(std::memory_order_relaxed);
+                }
+            }
+            TTarget* target = c->target;
+            c->target = NullType::singleton();
+            c->sequence.store(pos + mask_ + 1, std::memory_order_release); // free the cell for the next lap
+            return ptr_type(target, raw::DontIncreaseRefCount{}); // adopt the ref that was moved in
+        }
+};
+
+} // inline namespace C10_INTRUSIVE_PTR_ABI_NAMESPACE
+} // namespace intrusive_ptr
+} // namespace c10
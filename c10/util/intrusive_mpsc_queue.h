@@ -0,0 +1,137 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <type_traits>
+
+#include "intrusive_ptr.h"
+
+namespace c10 {
+namespace intrusive_ptr {
+inline namespace C10_INTRUSIVE_PTR_ABI_NAMESPACE {
+
+/**
+ * Embed this in an intrusive_ptr_target subclass so it can be pushed into an intrusive_mpsc_queue
+ * e.g. struct Task : intrusive_ptr_target, mpsc_queue_hook {...}
+ * An object can be in at most one queue at a time, and only once. Pushing it again before it's been
+ * popped (e.g. pushing two copies of one handle) would overwrite its link and corrupt the queue,
+ * debug builds assert on that.
+ */
+class mpsc_queue_hook {
+    std::atomic<mpsc_queue_hook*> mpsc_next_;
+    // only maintained in debug builds, always present so the layout doesn't depend on NDEBUG
+    std::atomic<bool> mpsc_queued_;
+
+    template <class T, class N>
+    friend class intrusive_mpsc_queue;
+
+    public:
+        constexpr mpsc_queue_hook() noexcept : mpsc_next_(nullptr), mpsc_queued_(false) {}
+
+        // copying an object doesn't copy its position in a queue
+        mpsc_queue_hook(const mpsc_queue_hook&) noexcept : mpsc_queue_hook() {}
+
+        mpsc_queue_hook& operator=(const mpsc_queue_hook&) noexcept {
+            return *this;
+        }
+};
+
+/**
+ * Vyukov's intrusive multi-producer single-consumer queue.
+ * push() is wait-free (one exchange), pop() must only be called from one thread at a time.
+ * Same ownership rules as intrusive_list, the queue holds the strong ref that was pushed in
+ * so there's no allocation and no refcount traffic per element.
+ */
+template <class TTarget, class NullType=detail::intrusive_target_default_null_type<TTarget>>
+class intrusive_mpsc_queue final {
+    static_assert(std::is_base_of_v<mpsc_queue_hook, TTarget>, "TTarget needs to embed an mpsc_queue_hook");
+
+    using ptr_type = intrusive_ptr<TTarget, NullType>;
+
+    private:
+        // producers hammer head_ while the consumer walks tail_, keep them on separate cache lines
+        alignas(64) std::atomic<mpsc_queue_hook*> head_;
+        alignas(64) mpsc_queue_hook* tail_;
+        mpsc_queue_hook stub_; // always-present dummy node so head_/tail_ are never null
+
+        void push_(mpsc_queue_hook* node) noexcept {
+            node->mpsc_next_.store(nullptr, std::memory_order_relaxed);
+            // serialization point for producers
+            mpsc_queue_hook* prev = head_.exchange(node, std::memory_order_acq_rel);
+            // between the exchange and this store the list is briefly disconnected, pop() sees that as empty
+            prev->mpsc_next_.store(node, std::memory_order_release);
+        }
+
+        // tail_ has moved past node, hand the queue's ref back
+        ptr_type take_(mpsc_queue_hook* node) noexcept {
+#ifndef NDEBUG
+            node->mpsc_queued_.store(false, std::memory_order_relaxed);
+#endif
+            return ptr_type::reclaim(static_cast<TTarget*>(node));
+        }
+
+    public:
+        intrusive_mpsc_queue() noexcept : head_(&stub_), tail_(&stub_) {}
+
+        intrusive_mpsc_queue(const intrusive_mpsc_queue&) = delete;
+        intrusive_mpsc_queue& operator=(const intrusive_mpsc_queue&) = delete;
+
+        // no producers may be running by now
+        ~intrusive_mpsc_queue() noexcept {
+            while (pop().get() != NullType::singleton()) {}
+        }
+
+        // Safe from any number of threads. ptr's target must not already be in a queue
+        void push(ptr_type ptr) noexcept {
+            if (ptr.get() != NullType::singleton()) {
+#ifndef NDEBUG
+                bool already_queued = static_cast<mpsc_queue_hook*>(ptr.get())->mpsc_queued_.exchange(true, std::memory_order_relaxed);
+                assert(!already_queued && "element is already in a queue");
+#endif
+                push_(ptr.release());
+            }
+        }
+
+        /**
+         * Consumer only. Returns a null ptr when the queue is empty, or when a producer is
+         * in the middle of a push (the element shows up on a later pop, so just retry/poll).
+         */
+        ptr_type pop() noexcept {
+            mpsc_queue_hook* tail = tail_;
+            mpsc_queue_hook* next = tail->mpsc_next_.load(std::memory_order_acquire);
+            if (tail == &stub_) {
+                if (next == nullptr) {
+                    return ptr_type();
+                }
+                // skip over the stub
+                tail_ = next;
+                tail = next;
+                next = next->mpsc_next_.load(std::memory_order_acquire);
+            }
+            if (next != nullptr) {
+                tail_ = next;
+                return take_(tail);
+            }
+            if (tail != head_.load(std::memory_order_acquire)) {
+                return ptr_type(); // a producer swapped head_ but hasn't linked yet
+            }
+            // tail is the last real node, put the stub behind it so we can detach it
+            push_(&stub_);
+            next = tail->mpsc_next_.load(std::memory_order_acquire);
+            if (next != nullptr) {
+                tail_ = next;
+                return take_(tail);
+            }
+            return ptr_type();
+        }
+
+        // Consumer only, may report non-empty while a push is still being linked
+        bool empty() const noexcept {
+            return tail_ == &stub_ && stub_.mpsc_next_.load(std::memory_order_acquire) == nullptr
+                && head_.load(std::memory_order_acquire) == &stub_;
+        }
+};
+
+} // inline namespace C10_INTRUSIVE_PTR_ABI_NAMESPACE
+} // namespace intrusive_ptr
+} // namespace c10
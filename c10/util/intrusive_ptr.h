@@ -1,10 +1,25 @@
 #pragma once
 
 #include <atomic>
+#include <cstdint>
 #include <memory>
+#include <stdexcept>
 #include <type_traits>
 #include <iostream>
 
+/**
+ * C10_INTRUSIVE_PTR_METRICS (see metrics.h) changes the bodies of inline and template functions here,
+ * so it's a build-wide flag: every translation unit has to be compiled with the same setting.
+ * To keep a mismatch from being a silent ODR violation everything in c10::intrusive_ptr (and c10::metrics)
+ * lives in an inline namespace named after the setting. Both variants then are distinct entities, and
+ * handing a handle/container across TUs built differently fails to link instead of miscounting.
+ */
+#ifdef C10_INTRUSIVE_PTR_METRICS
+#define C10_INTRUSIVE_PTR_ABI_NAMESPACE with_metrics
+#else
+#define C10_INTRUSIVE_PTR_ABI_NAMESPACE without_metrics
+#endif
+
 // Use this as a friend class later
 namespace pybind11 {
 template <typename, typename...>
@@ -17,12 +32,16 @@ namespace raw {
 struct DontIncreaseRefCount {};
 } // namespace raw
 namespace intrusive_ptr {
+inline namespace C10_INTRUSIVE_PTR_ABI_NAMESPACE {
 
 namespace detail {
 // TODO look line 30, they have some constants stored here
 constexpr uint64_t kReferenceCountOne = 1; // to increment the reference count by 1
 constexpr uint64_t kWeakReferenceCountOne = (kReferenceCountOne << 32);
 constexpr uint64_t kUniqueRef = (kReferenceCountOne | kWeakReferenceCountOne); // one strong ref, strong refs add a weak ref
+// Immortal targets park both counts at 2^31, nothing real gets there and stray inc/decs can't bring them to 0
+constexpr uint64_t kImmortalRefcountBit = (kReferenceCountOne << 31);
+constexpr uint64_t kImmortalRefcount = (kImmortalRefcountBit | (kWeakReferenceCountOne << 31));
 
 // Default NullType for pointer, for specialized cases
 template <class TTarget>
@@ -32,6 +51,34 @@ struct intrusive_target_default_null_type final {
     }
 };
 
+// Targets that never hand out weak refs can opt out with
+//   static constexpr bool kDisableWeakReferences = true;
+// then releasing is always exactly one fetch_sub + delete on zero: no kUniqueRef load/compare first,
+// no weak bookkeeping and no release_resources(). The default path saves the RMW on a unique handle,
+// this one saves the extra load on every shared one.
+template <class TTarget, class = void>
+struct has_weak_references : std::true_type {};
+
+template <class TTarget>
+struct has_weak_references<TTarget, std::void_t<decltype(TTarget::kDisableWeakReferences)>>
+    : std::bool_constant<!TTarget::kDisableWeakReferences> {};
+
+template <class TTarget>
+constexpr bool has_weak_references_v = has_weak_references<TTarget>::value;
+
+// Targets that may be frozen with make_immortal() opt in with
+//   static constexpr bool kAllowImmortal = true;
+// only they pay for the immortal check, everyone else retains with a single fetch_add
+template <class TTarget, class = void>
+struct allows_immortal : std::false_type {};
+
+template <class TTarget>
+struct allows_immortal<TTarget, std::void_t<decltype(TTarget::kAllowImmortal)>>
+    : std::bool_constant<TTarget::kAllowImmortal> {};
+
+template <class TTarget>
+constexpr bool allows_immortal_v = allows_immortal<TTarget>::value;
+
 // The refcount is a 64 bit int, split into ref count(first 32 bits) and then weak ref count(last 32 bits)
 inline uint32_t refcount(uint64_t combined_refcount) {
   return static_cast<uint32_t>(combined_refcount);
@@ -41,6 +88,10 @@ inline uint32_t weakcount(uint64_t combined_refcount) {
   return static_cast<uint32_t>(combined_refcount >> 32);
 }
 
+inline bool is_immortal(uint64_t combined_refcount) {
+  return (combined_refcount & kImmortalRefcountBit) != 0;
+}
+
 inline uint64_t combined_refcount_incrememt(std::atomic<uint64_t>& combined_refcount, uint64_t inc) {
     return combined_refcount.fetch_add(inc, std::memory_order_relaxed) + inc;
 }
@@ -66,6 +117,12 @@ inline uint32_t atomic_weakcount_decrement(std::atomic<uint64_t>& combined_refco
 
 // TODO define import/export macros, figure out what those do
 
+template <class TTarget>
+class compact_intrusive_ptr;
+
+template <class T, class TOwner>
+class aliasing_intrusive_ptr;
+
 // So e.g. how you have a shared_ptr<T>, we will have an intrusive_ptr<T>
 class intrusive_ptr_target{
     mutable std::atomic<uint64_t> combined_refcount_;
@@ -75,6 +132,8 @@ class intrusive_ptr_target{
 
     template <typename T, typename N>
     friend class intrusive_ptr;
+    template <typename T>
+    friend class compact_intrusive_ptr;
 
     protected:
         virtual ~intrusive_ptr_target() {}
@@ -112,6 +171,123 @@ class intrusive_ptr_target{
 
 using weak_intrusive_ptr_target = intrusive_ptr_target; // to help distinguish
 
+namespace detail {
+// Round-robin slot per thread, picked on first use, so threads spread evenly over the shards
+inline uint32_t this_thread_shard_slot() {
+    static std::atomic<uint32_t> next_slot{0};
+    thread_local uint32_t slot = next_slot.fetch_add(1, std::memory_order_relaxed);
+    return slot;
+}
+
+#ifdef C10_INTRUSIVE_PTR_METRICS
+// Build with -DC10_INTRUSIVE_PTR_METRICS everywhere (see the top of this file) to count live targets,
+// exported by c10/util/metrics.h.
+// Sharded per thread like the metrics counters, creating/destroying targets shouldn't serialize on one line
+struct alignas(64) live_target_cell {
+    std::atomic<int64_t> count{0};
+};
+constexpr size_t kNumLiveTargetCells = 16;
+inline live_target_cell live_target_cells[kNumLiveTargetCells];
+
+inline void count_live_targets(int64_t delta) {
+    live_target_cells[this_thread_shard_slot() % kNumLiveTargetCells].count.fetch_add(delta, std::memory_order_relaxed);
+}
+
+inline int64_t live_target_count() {
+    int64_t total = 0;
+    for (auto& cell : live_target_cells) {
+        total += cell.count.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+#endif
+} // namespace detail
+
+/**
+ * Opt-in scalable refcount for a few extremely hot targets (global model, shared vocab...).
+ * Instead of everyone hitting combined_refcount_, each thread inc/decs its own cache-line sized shard,
+ * so retain/release never bounce a shared line. Shards can go negative (retain on one thread, release
+ * on another), only their sum means anything, so while the target is live we can't tell if it hit zero.
+ * A bias on the central count keeps it alive until the owner calls retire(): that folds every shard into
+ * the central count and from then on all inc/decs go there, like a normal refcount.
+ * Same idea as the kernel's percpu_ref. No weak refs, and ~4KB per object so only use it where it pays.
+ */
+class sharded_intrusive_ptr_target : public intrusive_ptr_target {
+    static constexpr size_t kNumShards = 64;
+    static constexpr int64_t kShardRetired = INT64_MIN; // a live shard never gets there
+    static constexpr int64_t kLiveBias = (int64_t(1) << 62);
+
+    struct alignas(64) shard {
+        std::atomic<int64_t> count{0};
+    };
+
+    mutable shard shards_[kNumShards];
+    mutable std::atomic<int64_t> central_count_;
+    mutable std::atomic<bool> retired_;
+
+    template <typename T, typename N>
+    friend class intrusive_ptr;
+
+    // Returns false if the shard was already folded, then the caller goes to central_count_
+    bool shard_add_(int64_t delta) const noexcept {
+        auto& count = shards_[detail::this_thread_shard_slot() % kNumShards].count;
+        int64_t current = count.load(std::memory_order_relaxed);
+        while (current != kShardRetired) {
+            // uncontended unless two threads share a slot, the line stays in this core's cache
+            // acq_rel so a release here is ordered before retire() folds it and someone deletes
+            if (count.compare_exchange_weak(current, current + delta, std::memory_order_acq_rel, std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void retain_n_(uint32_t n) const noexcept {
+        if (!shard_add_(n)) {
+            central_count_.fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+
+    // true when that was the last ref and the target should be deleted
+    bool release_n_(uint32_t n) const noexcept {
+        if (shard_add_(-int64_t(n))) {
+            return false; // live bias is still in central_count_, can't be zero
+        }
+        return central_count_.fetch_sub(n, std::memory_order_acq_rel) == int64_t(n);
+    }
+
+    protected:
+        // The creating intrusive_ptr owns one ref, on top of the live bias
+        sharded_intrusive_ptr_target() noexcept : central_count_(kLiveBias + 1), retired_(false) {}
+
+        sharded_intrusive_ptr_target(const sharded_intrusive_ptr_target&) noexcept : sharded_intrusive_ptr_target() {}
+
+        sharded_intrusive_ptr_target& operator=(const sharded_intrusive_ptr_target&) noexcept {
+            return *this;
+        }
+
+    public:
+        static constexpr bool kDisableWeakReferences = true;
+
+        /**
+         * Switch to a single central count so the target can die once the last handle goes.
+         * Call it once, through a handle you still hold, when the target is being replaced or shut down.
+         * Without it the target is never freed. Safe to race with other threads' retain/release.
+         */
+        void retire() const noexcept {
+            if (retired_.exchange(true, std::memory_order_acq_rel)) {
+                return;
+            }
+            int64_t folded = 0;
+            for (auto& s : shards_) {
+                // whatever landed in a shard before this is counted, everything after goes to central_count_
+                folded += s.count.exchange(kShardRetired, std::memory_order_acq_rel);
+            }
+            // the caller's handle keeps this above zero
+            central_count_.fetch_add(folded - kLiveBias, std::memory_order_acq_rel);
+        }
+};
+
 // TODO still not sure when you use the weak target or pointer
 
 template <class TTarget, class NullType>
@@ -129,6 +305,9 @@ class intrusive_ptr final {
         template <class TT2, class NT2>
         friend class intrusive_ptr;
         friend class weak_intrusive_ptr<TTarget, NullType>;
+        friend class compact_intrusive_ptr<TTarget>; // reuses retain_n_/drop_refs_
+        template <class T, class TOwner>
+        friend class aliasing_intrusive_ptr; // reuses retain_n_/release_n_
 
         // Require for pybind https://pybind11.readthedocs.io/en/stable/advanced/smart_ptrs.html#custom-smart-pointers
         template <typename, typename...>
@@ -136,33 +315,83 @@ class intrusive_ptr final {
 
         void retain_() {
             if (target_ != NullType::singleton()) {
-                detail::atomic_refcount_increment(target_->combined_refcount_);
+                retain_n_(target_, 1);
             }
         }
 
         void reset_() {
             if (target_ != NullType::singleton()) {
-                if (target_->combined_refcount_.load(std::memory_order_acquire) == detail::kUniqueRef) {
-                    // No weak references and we're releasing the last strong reference
-                    // No other references to this thing, so we can safely destroy it and return
-                    target_->combined_refcount_.store(0, std::memory_order_relaxed);
-                    delete target_; // automatically releases resources
-                    return;
+                release_n_(target_, 1);
+            }
+        }
+
+        // Adds n strong refs with one RMW, so fanning out to n consumers costs the same as one copy
+        static void retain_n_(TTarget* target, uint32_t n) {
+            // each kind of target only instantiates its own path, sharded ones never touch combined_refcount_
+            if constexpr (std::is_base_of_v<sharded_intrusive_ptr_target, TTarget>) {
+                target->sharded_intrusive_ptr_target::retain_n_(n);
+            } else {
+                if constexpr (detail::allows_immortal_v<TTarget>) {
+                    // a plain load keeps the cache line shared between threads, only RMWs fight over it
+                    if (detail::is_immortal(target->combined_refcount_.load(std::memory_order_relaxed))) {
+                        return;
+                    }
                 }
+                detail::combined_refcount_incrememt(target->combined_refcount_, n * detail::kReferenceCountOne);
+            }
+        }
+
+        // Drops n strong refs with one RMW, n == 1 is the regular reset
+        static void release_n_(TTarget* target, uint32_t n) {
+            if (drop_refs_(target, n)) {
+                delete target; // automatically releases resources
+#ifdef C10_INTRUSIVE_PTR_METRICS
+                detail::count_live_targets(-1);
+#endif
+            }
+        }
 
-                auto combined_refcount = detail::combined_refcount_decrement(target_->combined_refcount_, detail::kReferenceCountOne);
-                if (detail::refcount(combined_refcount) == 0) {
-                    // no more strong refs, release the resources to start
-                    bool should_delete = (combined_refcount == detail::kWeakReferenceCountOne); // this was the last strong ref
-                    if (!should_delete) {
-                        // remove_const_t removes const from the type, const_cast removes it from the var
-                        const_cast<std::remove_const_t<TTarget>*>(target_)->release_resources();
-                        should_delete = detail::atomic_weakcount_decrement(target_->combined_refcount_) == 0; // another thread may concurrently decrement the count
+        // The refcounting half of release_n_, returns true when the caller has to destroy the target.
+        // Split out so handles that don't own their memory through new/delete (compact_intrusive_ptr) share it
+        static bool drop_refs_(TTarget* target, uint32_t n) {
+            if constexpr (std::is_base_of_v<sharded_intrusive_ptr_target, TTarget>) {
+                return target->sharded_intrusive_ptr_target::release_n_(n);
+            } else if constexpr (!detail::has_weak_references_v<TTarget>) {
+                // nobody can be holding a weak ref, so strong hitting 0 means we're the last one out.
+                // No load before the RMW, under contention that read costs its own cache-line transition
+                if constexpr (detail::allows_immortal_v<TTarget>) {
+                    if (detail::is_immortal(target->combined_refcount_.load(std::memory_order_relaxed))) {
+                        return false;
                     }
-                    if (should_delete) {
-                        delete target_;
+                }
+                auto combined_refcount = detail::combined_refcount_decrement(target->combined_refcount_, n * detail::kReferenceCountOne);
+                return detail::refcount(combined_refcount) == 0;
+            } else {
+                auto current_refcount = target->combined_refcount_.load(std::memory_order_acquire);
+                if constexpr (detail::allows_immortal_v<TTarget>) {
+                    if (detail::is_immortal(current_refcount)) {
+                        return false; // never dies, so handles are effectively borrowed pointers
                     }
                 }
+                if (current_refcount == n * detail::kReferenceCountOne + detail::kWeakReferenceCountOne) {
+                    // No weak references and we're releasing the last strong reference(s)
+                    // No other references to this thing, so we can safely destroy it and return
+                    target->combined_refcount_.store(0, std::memory_order_relaxed);
+                    return true;
+                }
+
+                auto combined_refcount = detail::combined_refcount_decrement(target->combined_refcount_, n * detail::kReferenceCountOne);
+                if (detail::refcount(combined_refcount) != 0) {
+                    return false;
+                }
+                // no more strong refs, release the resources to start
+                bool should_delete = (combined_refcount == detail::kWeakReferenceCountOne); // this was the last strong ref
+                if (!should_delete) {
+                    // remove_const_t removes const from the type, const_cast removes it from the var
+                    const_cast<std::remove_const_t<TTarget>*>(target)->release_resources();
+                    should_delete = detail::atomic_weakcount_decrement(target->combined_refcount_) == 0; // another thread may concurrently decrement the count
+                }
+                return should_delete;
             }
         }
 
@@ -170,6 +399,9 @@ class intrusive_ptr final {
         explicit intrusive_ptr(TTarget* target) : intrusive_ptr(target, raw::DontIncreaseRefCount{}) {
             if (target_ != NullType::singleton()) {
                 target->combined_refcount_.store(detail::kUniqueRef, std::memory_order_relaxed); // initialize with 1 weak and 1 strong ref since strong>0 --> weak>0
+#ifdef C10_INTRUSIVE_PTR_METRICS
+                detail::count_live_targets(1);
+#endif
             }
         }
 
@@ -216,6 +448,13 @@ class intrusive_ptr final {
             // tmp will destruct now, calling reset() on whatever we had before
         }
 
+        // Move =, same trick, tmp takes whatever we had before and drops it
+        intrusive_ptr& operator=(intrusive_ptr&& rhs) & noexcept {
+            intrusive_ptr tmp = std::move(rhs);
+            std::swap(target_, tmp.target_);
+            return *this;
+        }
+
         // Compiler does reference collapsing so T& && --> T&, T&& & --> T&&
         template <class ...Args>
         static intrusive_ptr make(Args&&... args) {
@@ -226,10 +465,111 @@ class intrusive_ptr final {
             return target_;
         }
 
+        // Give up ownership without touching the refcount, the caller is now responsible
+        // for the strong ref and has to hand it back through reclaim() eventually
+        TTarget* release() noexcept {
+            TTarget* result = target_;
+            target_ = NullType::singleton();
+            return result;
+        }
+
+        // Opposite of release(), adopt a pointer that already carries one strong ref
+        static intrusive_ptr reclaim(TTarget* owning_ptr) noexcept {
+            return intrusive_ptr(owning_ptr, raw::DontIncreaseRefCount{});
+        }
+
+        /**
+         * Writes n new owning handles to out, e.g. share_n(n, std::back_inserter(v)),
+         * with a single fetch_add on combined_refcount_ instead of n copies.
+         */
+        template <class OutputIt>
+        OutputIt share_n(uint32_t n, OutputIt out) const {
+            if (n == 0 || target_ == NullType::singleton()) {
+                for (uint32_t i = 0; i < n; ++i) {
+                    *out++ = intrusive_ptr();
+                }
+                return out;
+            }
+            retain_n_(target_, n);
+            uint32_t i = 0;
+            try {
+                for (; i < n; ++i) {
+                    intrusive_ptr handle(target_, raw::DontIncreaseRefCount{}); // adopts one of the new refs
+                    *out++ = std::move(handle);
+                }
+            } catch (...) {
+                // handle i gave its ref back when it was destroyed, the ones after it were never handed out
+                if (n - i - 1 > 0) {
+                    release_n_(target_, n - i - 1);
+                }
+                throw;
+            }
+            return out;
+        }
+
+        /**
+         * Bulk version of reset: drops every handle in [first, last) with a single fetch_sub.
+         * All of them have to point to the same target (or be null), they're all null afterwards.
+         * Throws std::invalid_argument and leaves the handles alone if they don't.
+         */
+        template <class ForwardIt>
+        static void release_n(ForwardIt first, ForwardIt last) {
+            TTarget* target = NullType::singleton();
+            uint32_t n = 0;
+            // check first, dropping n refs off the wrong target would be a use-after-free later
+            for (ForwardIt it = first; it != last; ++it) {
+                TTarget* t = it->get();
+                if (t == NullType::singleton()) {
+                    continue;
+                }
+                if (target != NullType::singleton() && target != t) {
+                    throw std::invalid_argument("release_n needs every handle to point to the same target");
+                }
+                target = t;
+                ++n;
+            }
+            if (n == 0) {
+                return;
+            }
+            for (; first != last; ++first) {
+                first->release();
+            }
+            release_n_(target, n);
+        }
+
         void swap(intrusive_ptr rhs) {
             std::swap(target_, rhs.target_);
         }
 
+        /**
+         * Freeze step: the target will never be destroyed, and from now on copying/destroying handles
+         * to it skips the atomic RMWs on combined_refcount_ (e.g. weights of a frozen model shared by
+         * every executor thread). Call it while no other thread is copying or releasing handles to the
+         * target. The object is intentionally leaked.
+         * The target type has to opt in with kAllowImmortal (see detail::allows_immortal).
+         * Not for sharded targets, they don't count in combined_refcount_ (never retire() them instead).
+         */
+        void make_immortal() const noexcept {
+            static_assert(!std::is_base_of_v<sharded_intrusive_ptr_target, TTarget>,
+                "sharded targets can't be made immortal, just don't retire() them");
+            static_assert(detail::allows_immortal_v<TTarget>,
+                "declare static constexpr bool kAllowImmortal = true on the target to use make_immortal()");
+            if (target_ != NullType::singleton()) {
+                target_->combined_refcount_.store(detail::kImmortalRefcount, std::memory_order_release);
+            }
+        }
+
+        bool is_immortal() const noexcept {
+            static_assert(!std::is_base_of_v<sharded_intrusive_ptr_target, TTarget>,
+                "sharded targets can't be made immortal, just don't retire() them");
+            if constexpr (!detail::allows_immortal_v<TTarget>) {
+                return false;
+            } else {
+                return target_ != NullType::singleton()
+                    && detail::is_immortal(target_->combined_refcount_.load(std::memory_order_relaxed));
+            }
+        }
+
         void getStrong() const {
             std::cout << target_->refcount() << std::endl;
         }
@@ -240,5 +580,6 @@ inline intrusive_ptr<TTarget, NullType> make_intrusive(Args&&... args) {
     return intrusive_ptr<TTarget, NullType>::make(std::forward<Args>(args)...); // forwarding so no unnecessary move
 }
 
+} // inline namespace C10_INTRUSIVE_PTR_ABI_NAMESPACE
 } // namespace intrusive_ptr
 } // namespace c10
\ No newline at end of file
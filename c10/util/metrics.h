@@ -0,0 +1,334 @@
+#pragma once
+
+#include <atomic>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "intrusive_ptr.h"
+
+namespace c10 {
+namespace metrics {
+inline namespace C10_INTRUSIVE_PTR_ABI_NAMESPACE {
+
+namespace detail {
+constexpr size_t kNumCells = 16;
+
+// One cache line per thread slot, updates from different threads never touch the same line
+struct alignas(64) cell {
+    std::atomic<int64_t> value{0};
+};
+
+inline size_t this_thread_cell() {
+    return intrusive_ptr::detail::this_thread_shard_slot() % kNumCells;
+}
+
+/**
+ * Sample values and le labels. The stream's default 6 significant digits would turn 12345678 into
+ * 1.23457e+07 and could give two close bucket bounds the same label, so integers are written as
+ * integers and everything else in the shortest form that parses back to the same double.
+ */
+inline void write_value(std::ostream& out, double v) {
+    if (std::isnan(v)) {
+        out << "NaN";
+    } else if (std::isinf(v)) {
+        out << (v > 0 ? "+Inf" : "-Inf");
+    } else if (v == std::trunc(v) && std::fabs(v) < 9007199254740992.0) { // 2^53, every integer below is exact
+        out << static_cast<int64_t>(v);
+    } else {
+        char buf[32];
+        auto result = std::to_chars(buf, buf + sizeof(buf), v);
+        out.write(buf, result.ptr - buf);
+    }
+}
+
+// HELP text is one line, the text format wants backslashes and newlines escaped
+inline void write_help(std::ostream& out, const std::string& help) {
+    for (char c : help) {
+        if (c == '\\') {
+            out << "\\\\";
+        } else if (c == '\n') {
+            out << "\\n";
+        } else {
+            out << c;
+        }
+    }
+}
+} // namespace detail
+
+enum class metric_type { counter, gauge, histogram };
+
+class metric {
+    std::string name_;
+    std::string help_;
+    metric_type type_;
+
+    public:
+        metric(std::string name, std::string help, metric_type type)
+            : name_(std::move(name)), help_(std::move(help)), type_(type) {}
+
+        virtual ~metric() {}
+
+        const std::string& name() const noexcept {
+            return name_;
+        }
+
+        const std::string& help() const noexcept {
+            return help_;
+        }
+
+        metric_type type() const noexcept {
+            return type_;
+        }
+
+        // Prometheus text format samples, without the HELP/TYPE header
+        virtual void write_samples(std::ostream& out) const = 0;
+};
+
+/**
+ * Lock-free sharded integer. Every update is one relaxed fetch_add on this thread's cell,
+ * reading sums the cells so it's only as consistent as a concurrent snapshot can be.
+ * counter only goes up, gauge goes both ways (queue depth, bytes in use...).
+ */
+class sharded_value : public metric {
+    detail::cell cells_[detail::kNumCells];
+
+    public:
+        using metric::metric;
+
+        void add(int64_t delta = 1) noexcept {
+            cells_[detail::this_thread_cell()].value.fetch_add(delta, std::memory_order_relaxed);
+        }
+
+        int64_t value() const noexcept {
+            int64_t total = 0;
+            for (auto& c : cells_) {
+                total += c.value.load(std::memory_order_relaxed);
+            }
+            return total;
+        }
+
+        void write_samples(std::ostream& out) const override {
+            out << name() << ' ' << value() << '\n';
+        }
+};
+
+class counter final : public sharded_value {
+    public:
+        counter(std::string name, std::string help) : sharded_value(std::move(name), std::move(help), metric_type::counter) {}
+
+        void inc(int64_t n = 1) noexcept {
+            add(n);
+        }
+};
+
+class gauge final : public sharded_value {
+    public:
+        gauge(std::string name, std::string help) : sharded_value(std::move(name), std::move(help), metric_type::gauge) {}
+
+        void inc(int64_t n = 1) noexcept {
+            add(n);
+        }
+
+        void dec(int64_t n = 1) noexcept {
+            add(-n);
+        }
+};
+
+// Gauge whose value is read at dump time, for things that already keep their own count
+class callback_gauge final : public metric {
+    std::function<double()> read_;
+
+    public:
+        callback_gauge(std::string name, std::string help, std::function<double()> read)
+            : metric(std::move(name), std::move(help), metric_type::gauge), read_(std::move(read)) {}
+
+        void write_samples(std::ostream& out) const override {
+            out << name() << ' ';
+            detail::write_value(out, read_());
+            out << '\n';
+        }
+};
+
+/**
+ * Fixed-bucket histogram (e.g. op latencies). Each thread slot has its own row of bucket counts
+ * plus a running sum, so observe() is a short scan over the bounds and two uncontended RMWs.
+ * Rows are stored inline and cache-line aligned so neighbouring slots never share a line,
+ * which caps the number of bounds at kMaxBounds.
+ */
+class histogram final : public metric {
+    public:
+        static constexpr size_t kMaxBounds = 31;
+
+    private:
+        struct alignas(64) row {
+            std::atomic<uint64_t> buckets[kMaxBounds + 1] = {}; // one per bound, plus +Inf
+            std::atomic<double> sum{0};
+        };
+
+        std::vector<double> bounds_;
+        row rows_[detail::kNumCells];
+
+        static std::vector<double> checked_bounds_(std::vector<double> bounds) {
+            if (bounds.size() > kMaxBounds) {
+                throw std::invalid_argument("histogram supports at most " + std::to_string(kMaxBounds) + " bounds");
+            }
+            return bounds;
+        }
+
+    public:
+        // bounds are the bucket upper limits, ascending, at most kMaxBounds of them
+        histogram(std::string name, std::string help, std::vector<double> bounds)
+            : metric(std::move(name), std::move(help), metric_type::histogram), bounds_(checked_bounds_(std::move(bounds))) {}
+
+        // Powers-of-`factor` bucket bounds starting at `start`, the usual choice for latencies
+        static std::vector<double> exponential_bounds(double start, double factor, size_t count) {
+            std::vector<double> bounds;
+            for (size_t i = 0; i < count; ++i, start *= factor) {
+                bounds.push_back(start);
+            }
+            return bounds;
+        }
+
+        void observe(double v) noexcept {
+            size_t bucket = 0;
+            while (bucket < bounds_.size() && v > bounds_[bucket]) {
+                ++bucket;
+            }
+            row& r = rows_[detail::this_thread_cell()];
+            r.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+            // no fetch_add for double before C++20, the cell is ours so this almost never loops
+            double sum = r.sum.load(std::memory_order_relaxed);
+            while (!r.sum.compare_exchange_weak(sum, sum + v, std::memory_order_relaxed)) {}
+        }
+
+        void write_samples(std::ostream& out) const override {
+            uint64_t cumulative = 0;
+            double sum = 0;
+            for (size_t b = 0; b <= bounds_.size(); ++b) {
+                for (auto& r : rows_) {
+                    cumulative += r.buckets[b].load(std::memory_order_relaxed);
+                }
+                out << name() << "_bucket{le=\"";
+                if (b < bounds_.size()) {
+                    detail::write_value(out, bounds_[b]);
+                } else {
+                    out << "+Inf";
+                }
+                out << "\"} " << cumulative << '\n';
+            }
+            for (auto& r : rows_) {
+                sum += r.sum.load(std::memory_order_relaxed);
+            }
+            out << name() << "_sum ";
+            detail::write_value(out, sum);
+            out << '\n';
+            out << name() << "_count " << cumulative << '\n';
+        }
+};
+
+/**
+ * Process-wide set of metrics. Registering takes a mutex (do it once, keep the reference),
+ * updating a registered metric never does. Metrics live as long as the registry.
+ * Registering a name twice returns the existing metric, so libraries can share e.g. an allocator counter.
+ */
+class registry final {
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<metric>> metrics_;
+
+    template <class M, class... Args>
+    M& get_or_add_(const std::string& name, Args&&... args) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        for (auto& m : metrics_) {
+            if (m->name() == name) {
+                M* existing = dynamic_cast<M*>(m.get());
+                if (existing == nullptr) {
+                    throw std::logic_error("metric " + name + " already registered with a different type");
+                }
+                return *existing;
+            }
+        }
+        metrics_.push_back(std::make_unique<M>(name, std::forward<Args>(args)...));
+        return static_cast<M&>(*metrics_.back());
+    }
+
+    public:
+        registry() {
+#ifdef C10_INTRUSIVE_PTR_METRICS
+            add_callback_gauge("c10_intrusive_ptr_live_targets", "intrusive_ptr_targets currently alive",
+                [] { return static_cast<double>(intrusive_ptr::detail::live_target_count()); });
+#endif
+        }
+
+        registry(const registry&) = delete;
+        registry& operator=(const registry&) = delete;
+
+        // Leaked on purpose so metrics can still be updated from other statics' destructors
+        static registry& global() {
+            static registry* instance = new registry();
+            return *instance;
+        }
+
+        counter& add_counter(const std::string& name, const std::string& help) {
+            return get_or_add_<counter>(name, help);
+        }
+
+        gauge& add_gauge(const std::string& name, const std::string& help) {
+            return get_or_add_<gauge>(name, help);
+        }
+
+        callback_gauge& add_callback_gauge(const std::string& name, const std::string& help, std::function<double()> read) {
+            return get_or_add_<callback_gauge>(name, help, std::move(read));
+        }
+
+        histogram& add_histogram(const std::string& name, const std::string& help, std::vector<double> bounds) {
+            return get_or_add_<histogram>(name, help, std::move(bounds));
+        }
+
+        // Prometheus text exposition format
+        void write_prometheus(std::ostream& out) const {
+            std::lock_guard<std::mutex> guard(mutex_);
+            for (auto& m : metrics_) {
+                const char* type = m->type() == metric_type::counter ? "counter"
+                    : m->type() == metric_type::gauge ? "gauge" : "histogram";
+                out << "# HELP " << m->name() << ' ';
+                detail::write_help(out, m->help());
+                out << '\n';
+                out << "# TYPE " << m->name() << ' ' << type << '\n';
+                m->write_samples(out);
+            }
+        }
+
+        /**
+         * Dump to path, e.g. for node_exporter's textfile collector. Writes a temp file and renames it
+         * so a scraper never sees half a dump. Returns false if the file couldn't be written.
+         */
+        bool dump_prometheus(const std::string& path) const {
+            std::string tmp_path = path + ".tmp";
+            {
+                std::ofstream out(tmp_path, std::ios::trunc);
+                if (!out) {
+                    return false;
+                }
+                write_prometheus(out);
+                if (!out.flush()) {
+                    return false;
+                }
+            }
+            return std::rename(tmp_path.c_str(), path.c_str()) == 0;
+        }
+};
+
+} // inline namespace C10_INTRUSIVE_PTR_ABI_NAMESPACE
+} // namespace metrics
+} // namespace c10
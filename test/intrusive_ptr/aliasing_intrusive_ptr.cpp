@@ -0,0 +1,123 @@
+#include "../../c10/util/aliasing_intrusive_ptr.h"
+#include "../test_utils.h"
+
+#include <iostream>
+#include <utility>
+
+using namespace c10::intrusive_ptr;
+
+struct Blob : intrusive_ptr_target, test::counts_destruction {
+    float weights[4] = {1, 2, 3, 4};
+    int header = 7;
+};
+
+// The refcount is private, so these check it through when the parent dies: exactly when the last
+// handle or alias goes, never earlier (use-after-free) and never later (a leaked ref)
+
+// The parent outlives its owner handle for as long as any alias is left
+void test_owner_outlives_aliases() {
+    test::destructed = 0;
+    {
+        auto blob = make_intrusive<Blob>();
+        auto weight = make_aliasing_intrusive(blob, &blob.get()->weights[2]);
+        aliasing_intrusive_ptr<int, Blob> header(weight, &blob.get()->header); // another view, same parent
+        CHECK(weight.owner() == blob.get());
+        CHECK(header.owner() == blob.get());
+
+        blob = intrusive_ptr<Blob>();
+        CHECK(test::destructed == 0);
+        CHECK(*weight == 3);
+        weight = aliasing_intrusive_ptr<float, Blob>();
+        CHECK(test::destructed == 0);
+        CHECK(*header == 7);
+    }
+    CHECK(test::destructed == 1);
+}
+
+// An rvalue owner hands its ref over: the owner is null afterwards and one alias is enough to free the parent
+void test_adopt_rvalue_owner() {
+    test::destructed = 0;
+    auto blob = make_intrusive<Blob>();
+    float* interior = &blob.get()->weights[0];
+    aliasing_intrusive_ptr<float, Blob> weight(std::move(blob), interior);
+    CHECK(blob.get() == nullptr);
+    CHECK(weight.get() == interior && *weight == 1);
+    weight = nullptr;
+    CHECK(test::destructed == 1); // an extra ref taken on adoption would have leaked the parent
+
+    auto other = make_intrusive<Blob>();
+    int* header = &other.get()->header;
+    auto via_helper = make_aliasing_intrusive(std::move(other), header);
+    CHECK(other.get() == nullptr);
+    via_helper = nullptr;
+    CHECK(test::destructed == 2);
+}
+
+// owner_handle() is one more strong ref on the parent, and an alias can be rebuilt from it
+void test_owner_handle_round_trip() {
+    test::destructed = 0;
+    {
+        aliasing_intrusive_ptr<int, Blob> header;
+        CHECK(header.owner_handle().get() == nullptr);
+        {
+            auto blob = make_intrusive<Blob>();
+            header = make_aliasing_intrusive(blob, &blob.get()->header);
+        }
+        intrusive_ptr<Blob> owner = header.owner_handle();
+        CHECK(owner.get() == header.owner());
+        auto weight = make_aliasing_intrusive(owner, &owner.get()->weights[3]);
+        CHECK(*weight == 4);
+
+        header = nullptr;
+        owner = intrusive_ptr<Blob>();
+        CHECK(test::destructed == 0); // weight still holds it
+        weight = nullptr;
+        CHECK(test::destructed == 1);
+    }
+    CHECK(test::destructed == 1);
+}
+
+void test_copy_and_move_assignment() {
+    test::destructed = 0;
+    {
+        auto a = make_intrusive<Blob>();
+        auto b = make_intrusive<Blob>();
+        auto from_a = make_aliasing_intrusive(a, &a.get()->header);
+        auto from_b = make_aliasing_intrusive(b, &b.get()->header);
+        Blob* raw_a = a.get();
+        a = intrusive_ptr<Blob>();
+        b = intrusive_ptr<Blob>();
+
+        // copy assignment: both point at a's parent, b's parent loses its last ref
+        from_b = from_a;
+        CHECK(test::destructed == 1);
+        CHECK(from_b.owner() == raw_a && from_b.get() == &raw_a->header);
+
+        // self-assignment keeps the ref
+        auto& same = from_b;
+        from_b = same;
+        CHECK(from_b.owner() == raw_a);
+
+        // move assignment: the source is emptied, no ref is gained or lost
+        aliasing_intrusive_ptr<int, Blob> moved;
+        moved = std::move(from_a);
+        CHECK(from_a.get() == nullptr && from_a.owner() == nullptr);
+        CHECK(moved.owner() == raw_a);
+        from_b = nullptr;
+        CHECK(test::destructed == 1);
+
+        aliasing_intrusive_ptr<int, Blob> moved_again(std::move(moved));
+        CHECK(moved.owner() == nullptr && moved_again.owner() == raw_a);
+        moved_again.swap(moved);
+        CHECK(moved.owner() == raw_a && moved_again.owner() == nullptr);
+    }
+    CHECK(test::destructed == 2);
+}
+
+int main() {
+    test_owner_outlives_aliases();
+    test_adopt_rvalue_owner();
+    test_owner_handle_round_trip();
+    test_copy_and_move_assignment();
+    std::cout << "aliasing_intrusive_ptr: all passed" << std::endl;
+}
@@ -0,0 +1,193 @@
+#include "../../c10/util/compact_intrusive_ptr.h"
+#include "../test_utils.h"
+
+#include <iostream>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace c10::intrusive_ptr;
+
+struct Node : intrusive_ptr_target, test::counts_destruction {
+    int id;
+    compact_intrusive_ptr<Node> next; // graph nodes hold handles to their own type
+
+    Node(int x) : id(x) {}
+};
+
+// Counts in its own destructor, a counts_destruction base would also count the unwind of a failed constructor
+struct Fails : intrusive_ptr_target {
+    static inline int destroyed = 0;
+
+    Fails(bool fail) {
+        if (fail) {
+            throw std::runtime_error("constructor failed");
+        }
+    }
+
+    ~Fails() {
+        destroyed++;
+    }
+};
+
+struct Sharded : sharded_intrusive_ptr_target, test::counts_destruction {};
+
+void test_null() {
+    compact_intrusive_ptr<Node> null;
+    CHECK(null.index() == 0);
+    CHECK(null.get() == nullptr);
+    compact_intrusive_ptr<Node> also_null = nullptr;
+    CHECK(also_null.get() == nullptr);
+    CHECK(intrusive_arena<Node>::global().get(0) == nullptr);
+
+    auto node = make_compact_intrusive<Node>(1);
+    CHECK(node.index() != 0); // 0 is never handed out
+}
+
+// Copies, moves and assignments share one object, it's destroyed exactly once with the last handle
+void test_ownership() {
+    test::destructed = 0;
+    {
+        auto a = make_compact_intrusive<Node>(1);
+        compact_intrusive_ptr<Node> b = a;
+        CHECK(b.index() == a.index() && b.get() == a.get());
+        compact_intrusive_ptr<Node> c = std::move(b);
+        CHECK(b.get() == nullptr && c.get() == a.get());
+
+        auto d = make_compact_intrusive<Node>(2);
+        d = c; // drops node 2
+        CHECK(test::destructed == 1);
+        CHECK(d->id == 1);
+        c = std::move(d);
+        a = compact_intrusive_ptr<Node>();
+        CHECK(test::destructed == 1);
+        c.swap(d);
+        CHECK(c.get() == nullptr && d->id == 1);
+    }
+    CHECK(test::destructed == 2);
+
+    // a chain is torn down link by link
+    test::destructed = 0;
+    {
+        auto head = make_compact_intrusive<Node>(0);
+        compact_intrusive_ptr<Node>* tail = &head;
+        for (int i = 1; i < 100; ++i) {
+            tail->get()->next = make_compact_intrusive<Node>(i);
+            tail = &tail->get()->next;
+        }
+    }
+    CHECK(test::destructed == 100);
+}
+
+// Freed slots go back on the free list and their index is handed out again
+void test_index_reuse() {
+    uint32_t index;
+    {
+        auto node = make_compact_intrusive<Node>(1);
+        index = node.index();
+    }
+    auto reused = make_compact_intrusive<Node>(2);
+    CHECK(reused.index() == index);
+    CHECK(reused->id == 2);
+}
+
+// More objects than one chunk holds, indices stay unique and every object stays where it was
+void test_many() {
+    test::destructed = 0;
+    {
+        std::vector<compact_intrusive_ptr<Node>> nodes;
+        std::vector<Node*> addresses;
+        std::set<uint32_t> indices;
+        for (int i = 0; i < 20000; ++i) {
+            nodes.push_back(make_compact_intrusive<Node>(i));
+            addresses.push_back(nodes.back().get());
+            indices.insert(nodes.back().index());
+        }
+        CHECK(indices.size() == nodes.size());
+        for (int i = 0; i < 20000; ++i) {
+            CHECK(nodes[i].get() == addresses[i] && nodes[i]->id == i);
+            CHECK(intrusive_arena<Node>::global().get(nodes[i].index()) == addresses[i]);
+        }
+    }
+    CHECK(test::destructed == 20000);
+}
+
+// Threads allocating while others look up their own indices, new chunks get published under their feet
+void test_threads() {
+    test::destructed = 0;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([t] {
+            std::vector<compact_intrusive_ptr<Node>> nodes;
+            for (int i = 0; i < 5000; ++i) {
+                nodes.push_back(make_compact_intrusive<Node>(t * 5000 + i));
+                make_compact_intrusive<Node>(-1); // freed right away, its slot gets reused meanwhile
+                CHECK(nodes[i / 2]->id == t * 5000 + i / 2);
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    CHECK(test::destructed == 40000);
+}
+
+// A throwing constructor gives its slot back and nothing is destroyed
+void test_create_throws() {
+    Fails::destroyed = 0;
+    auto ok = make_compact_intrusive<Fails>(false);
+    uint32_t freed;
+    {
+        auto tmp = make_compact_intrusive<Fails>(false);
+        freed = tmp.index();
+    }
+    CHECK(Fails::destroyed == 1);
+    bool threw = false;
+    try {
+        make_compact_intrusive<Fails>(true);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    CHECK(threw);
+    CHECK(Fails::destroyed == 1);
+    auto next = make_compact_intrusive<Fails>(false);
+    CHECK(next.index() == freed); // the slot the failed create took is free again
+
+    // same through a private arena
+    intrusive_arena<Fails> arena;
+    threw = false;
+    try {
+        arena.create(true);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    CHECK(threw);
+    uint32_t index = arena.create(false);
+    CHECK(index == 1);
+    arena.destroy(index);
+    CHECK(Fails::destroyed == 2);
+}
+
+// Sharded targets go through the same compact handle, refcounted on their shards
+void test_sharded() {
+    test::destructed = 0;
+    {
+        auto model = make_compact_intrusive<Sharded>();
+        compact_intrusive_ptr<Sharded> copy = model;
+        model->retire();
+    }
+    CHECK(test::destructed == 1);
+}
+
+int main() {
+    test_null();
+    test_ownership();
+    test_index_reuse();
+    test_many();
+    test_threads();
+    test_create_throws();
+    test_sharded();
+    std::cout << "compact_intrusive_ptr: all passed" << std::endl;
+}
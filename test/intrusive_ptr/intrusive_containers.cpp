@@ -0,0 +1,127 @@
+#include "../../c10/util/intrusive_list.h"
+#include "../../c10/util/intrusive_mpsc_queue.h"
+#include "../test_utils.h"
+
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using namespace c10::intrusive_ptr;
+
+struct Task : intrusive_ptr_target, intrusive_list_hook, mpsc_queue_hook, test::counts_destruction {
+    int id;
+
+    Task(int x) : id(x) {}
+};
+
+void test_list_order() {
+    intrusive_list<Task> list;
+    for (int i = 0; i < 5; ++i) {
+        list.push_back(make_intrusive<Task>(i));
+    }
+    list.push_front(make_intrusive<Task>(-1));
+    CHECK(list.size() == 6);
+    CHECK(list.front()->id == -1);
+    CHECK(list.back()->id == 4);
+
+    CHECK(list.pop_back().get()->id == 4);
+    for (int expected = -1; expected < 4; ++expected) {
+        auto task = list.pop_front();
+        CHECK(task.get()->id == expected);
+        CHECK(!static_cast<intrusive_list_hook*>(task.get())->is_linked());
+    }
+    CHECK(list.empty());
+    CHECK(list.pop_front().get() == nullptr);
+}
+
+// The list holds exactly one strong ref per element: it's handed back on pop/erase and dropped on clear/destruction
+void test_list_ownership() {
+    test::destructed = 0;
+    {
+        intrusive_list<Task> list;
+        auto kept = make_intrusive<Task>(1);
+        list.push_back(kept);                   // copy, list and kept share the target
+        list.push_back(make_intrusive<Task>(2)); // only the list owns this one
+        list.push_back(make_intrusive<Task>(3));
+
+        auto erased = list.erase(kept.get());
+        CHECK(erased.get() == kept.get());
+        CHECK(test::destructed == 0);
+
+        { auto popped = list.pop_front(); } // 2 dies with the popped handle
+        CHECK(test::destructed == 1);
+
+        list.clear(); // 3 dies
+        CHECK(test::destructed == 2);
+        CHECK(list.empty());
+
+        list.push_back(make_intrusive<Task>(4)); // destructor drops it
+    }
+    CHECK(test::destructed == 4); // kept/erased, 4
+}
+
+void test_mpsc_single_thread() {
+    test::destructed = 0;
+    {
+        intrusive_mpsc_queue<Task> queue;
+        CHECK(queue.empty());
+        CHECK(queue.pop().get() == nullptr);
+        for (int i = 0; i < 10; ++i) {
+            queue.push(make_intrusive<Task>(i));
+        }
+        for (int i = 0; i < 5; ++i) {
+            auto task = queue.pop();
+            CHECK(task.get() != nullptr && task.get()->id == i);
+        }
+        CHECK(test::destructed == 5);
+        // a popped element can go back in
+        auto task = queue.pop();
+        CHECK(task.get()->id == 5);
+        queue.push(task);
+    }
+    CHECK(test::destructed == 10); // the other 5 are released by the destructor, exactly once
+}
+
+void test_mpsc_producers() {
+    test::destructed = 0;
+    constexpr int kProducers = 4;
+    constexpr int kPerProducer = 20000;
+    {
+        intrusive_mpsc_queue<Task> queue;
+        std::vector<std::thread> producers;
+        for (int p = 0; p < kProducers; ++p) {
+            producers.emplace_back([&queue, p] {
+                for (int i = 0; i < kPerProducer; ++i) {
+                    queue.push(make_intrusive<Task>(p * kPerProducer + i));
+                }
+            });
+        }
+        std::vector<int> last(kProducers, -1);
+        int received = 0;
+        while (received < kProducers * kPerProducer) {
+            auto task = queue.pop();
+            if (task.get() == nullptr) {
+                std::this_thread::yield();
+                continue;
+            }
+            int producer = task.get()->id / kPerProducer;
+            int seq = task.get()->id % kPerProducer;
+            CHECK(seq > last[producer]); // FIFO per producer
+            last[producer] = seq;
+            ++received;
+        }
+        for (auto& t : producers) {
+            t.join();
+        }
+        CHECK(queue.empty());
+    }
+    CHECK(test::destructed == kProducers * kPerProducer);
+}
+
+int main() {
+    test_list_order();
+    test_list_ownership();
+    test_mpsc_single_thread();
+    test_mpsc_producers();
+    std::cout << "intrusive_containers: all passed" << std::endl;
+}
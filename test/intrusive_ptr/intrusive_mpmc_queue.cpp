@@ -0,0 +1,144 @@
+#include "../../c10/util/intrusive_mpmc_queue.h"
+#include "../test_utils.h"
+
+#include <atomic>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using namespace c10::intrusive_ptr;
+
+struct Batch : intrusive_ptr_target, test::counts_destruction {
+    int id;
+
+    Batch(int x) : id(x) {}
+};
+
+void test_bad_capacity() {
+    for (size_t capacity : {0, 1, 3, 6}) {
+        bool threw = false;
+        try {
+            intrusive_mpmc_queue<Batch> queue(capacity);
+        } catch (const std::invalid_argument&) {
+            threw = true;
+        }
+        CHECK(threw);
+    }
+}
+
+// Full queue rejects the push and leaves the caller's handle alone
+void test_full() {
+    test::destructed = 0;
+    {
+        intrusive_mpmc_queue<Batch> queue(4);
+        for (int i = 0; i < 4; ++i) {
+            CHECK(queue.try_push(make_intrusive<Batch>(i)));
+        }
+        auto extra = make_intrusive<Batch>(4);
+        Batch* raw = extra.get();
+        CHECK(!queue.try_push(extra));
+        CHECK(extra.get() == raw);
+        CHECK(queue.size_approx() == 4);
+
+        CHECK(queue.try_pop().get()->id == 0);
+        CHECK(queue.try_push(extra));
+        CHECK(extra.get() == nullptr);
+    }
+    CHECK(test::destructed == 5);
+}
+
+// Nulls are skipped rather than queued, so they can't hide the elements behind them
+void test_null() {
+    test::destructed = 0;
+    {
+        intrusive_mpmc_queue<Batch> queue(4);
+        CHECK(queue.try_push(intrusive_ptr<Batch>()));
+        CHECK(queue.try_push(make_intrusive<Batch>(7)));
+        CHECK(queue.size_approx() == 1);
+    }
+    CHECK(test::destructed == 1);
+}
+
+// Many laps around a small ring, FIFO order and sequence numbers have to survive wrapping
+void test_wrap_around() {
+    test::destructed = 0;
+    {
+        intrusive_mpmc_queue<Batch> queue(2);
+        for (int i = 0; i < 1000; ++i) {
+            CHECK(queue.try_push(make_intrusive<Batch>(2 * i)));
+            CHECK(queue.try_push(make_intrusive<Batch>(2 * i + 1)));
+            CHECK(queue.try_pop().get()->id == 2 * i);
+            CHECK(queue.try_pop().get()->id == 2 * i + 1);
+            CHECK(queue.try_pop().get() == nullptr);
+        }
+    }
+    CHECK(test::destructed == 2000);
+}
+
+void test_destructor_drains() {
+    test::destructed = 0;
+    {
+        intrusive_mpmc_queue<Batch> queue(8);
+        for (int i = 0; i < 6; ++i) {
+            CHECK(queue.try_push(make_intrusive<Batch>(i)));
+        }
+        CHECK(queue.try_pop().get()->id == 0);
+        CHECK(test::destructed == 1);
+    }
+    CHECK(test::destructed == 6);
+}
+
+void test_producers_consumers() {
+    test::destructed = 0;
+    constexpr int kProducers = 4;
+    constexpr int kConsumers = 4;
+    constexpr int kPerProducer = 20000;
+    std::vector<std::atomic<int>> seen(kProducers * kPerProducer);
+    {
+        intrusive_mpmc_queue<Batch> queue(16);
+        std::atomic<int> received{0};
+        std::vector<std::thread> threads;
+        for (int p = 0; p < kProducers; ++p) {
+            threads.emplace_back([&queue, p] {
+                for (int i = 0; i < kPerProducer; ++i) {
+                    auto batch = make_intrusive<Batch>(p * kPerProducer + i);
+                    while (!queue.try_push(batch)) {
+                        std::this_thread::yield();
+                    }
+                }
+            });
+        }
+        for (int c = 0; c < kConsumers; ++c) {
+            threads.emplace_back([&] {
+                while (received.load() < kProducers * kPerProducer) {
+                    auto batch = queue.try_pop();
+                    if (batch.get() == nullptr) {
+                        std::this_thread::yield();
+                        continue;
+                    }
+                    seen[batch.get()->id]++;
+                    received++;
+                }
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        CHECK(queue.try_pop().get() == nullptr);
+    }
+    for (auto& count : seen) {
+        CHECK(count == 1); // every element delivered exactly once
+    }
+    CHECK(test::destructed == kProducers * kPerProducer);
+}
+
+int main() {
+    test_bad_capacity();
+    test_full();
+    test_null();
+    test_wrap_around();
+    test_destructor_drains();
+    test_producers_consumers();
+    std::cout << "intrusive_mpmc_queue: all passed" << std::endl;
+}
@@ -0,0 +1,240 @@
+#include "../../c10/util/intrusive_ptr.h"
+#include "../test_utils.h"
+
+#include <atomic>
+#include <cstddef>
+#include <iostream>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using namespace c10::intrusive_ptr;
+
+struct Weights : intrusive_ptr_target, test::counts_destruction {
+    static constexpr bool kAllowImmortal = true;
+
+    int payload = 42;
+};
+
+struct Plain : intrusive_ptr_target, test::counts_destruction {};
+
+std::atomic<int> resources_released{0};
+
+struct WeakFree : intrusive_ptr_target, test::counts_destruction {
+    static constexpr bool kDisableWeakReferences = true;
+
+    int payload = 42;
+
+    void release_resources() override {
+        resources_released++;
+    }
+};
+
+static_assert(detail::has_weak_references_v<Plain>);
+static_assert(!detail::has_weak_references_v<WeakFree>);
+
+// Copies, moves, releases and bulk shares of an immortal target never destroy it
+void test_immortal() {
+    test::destructed = 0;
+    Weights* raw;
+    {
+        auto weights = make_intrusive<Weights>();
+        raw = weights.get();
+        CHECK(!weights.is_immortal());
+        weights.make_immortal();
+        CHECK(weights.is_immortal());
+
+        std::vector<intrusive_ptr<Weights>> shared;
+        weights.share_n(16, std::back_inserter(shared));
+        intrusive_ptr<Weights> copy = weights;
+        intrusive_ptr<Weights> moved = std::move(copy);
+        moved = shared[0];
+        intrusive_ptr<Weights>::release_n(shared.begin(), shared.begin() + 8);
+        shared.clear();
+        CHECK(moved.is_immortal());
+    }
+    CHECK(test::destructed == 0);
+
+    // still immortal once every handle is gone, and from other threads
+    auto again = intrusive_ptr<Weights>::reclaim(raw);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&again] {
+            for (int i = 0; i < 10000; ++i) {
+                intrusive_ptr<Weights> copy = again;
+                CHECK(copy.get()->payload == 42);
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    CHECK(again.is_immortal());
+    again = intrusive_ptr<Weights>();
+    CHECK(test::destructed == 0);
+
+    delete raw; // leaked on purpose, free it by hand so leak checkers stay quiet
+}
+
+// Targets that didn't opt in can't be immortal, is_immortal() is just false
+void test_not_immortal() {
+    test::destructed = 0;
+    {
+        auto plain = make_intrusive<Plain>();
+        CHECK(!plain.is_immortal());
+    }
+    CHECK(test::destructed == 1);
+}
+
+void test_share_n_release_n() {
+    test::destructed = 0;
+    {
+        auto plain = make_intrusive<Plain>();
+        std::vector<intrusive_ptr<Plain>> shared;
+        plain.share_n(0, std::back_inserter(shared));
+        CHECK(shared.empty());
+        plain.share_n(10, std::back_inserter(shared));
+        CHECK(shared.size() == 10);
+        for (auto& handle : shared) {
+            CHECK(handle.get() == plain.get());
+        }
+
+        shared.emplace_back(); // nulls are skipped
+        intrusive_ptr<Plain>::release_n(shared.begin(), shared.end());
+        for (auto& handle : shared) {
+            CHECK(handle.get() == nullptr);
+        }
+        CHECK(test::destructed == 0); // plain still holds its ref
+
+        // with the original in the range too, the bulk release is the last one
+        plain.share_n(3, std::back_inserter(shared));
+        shared.push_back(std::move(plain));
+        intrusive_ptr<Plain>::release_n(shared.begin(), shared.end());
+        CHECK(test::destructed == 1);
+
+        intrusive_ptr<Plain> null;
+        std::vector<intrusive_ptr<Plain>> nulls;
+        null.share_n(4, std::back_inserter(nulls));
+        CHECK(nulls.size() == 4 && nulls[3].get() == nullptr);
+        intrusive_ptr<Plain>::release_n(nulls.begin(), nulls.end());
+    }
+    CHECK(test::destructed == 1);
+}
+
+// A mixed range is rejected in every build, before any handle is touched
+void test_release_n_mixed_targets() {
+    test::destructed = 0;
+    {
+        std::vector<intrusive_ptr<Plain>> handles;
+        handles.push_back(make_intrusive<Plain>());
+        handles.push_back(make_intrusive<Plain>());
+        Plain* first = handles[0].get();
+        bool threw = false;
+        try {
+            intrusive_ptr<Plain>::release_n(handles.begin(), handles.end());
+        } catch (const std::invalid_argument&) {
+            threw = true;
+        }
+        CHECK(threw);
+        CHECK(handles[0].get() == first && handles[1].get() != nullptr);
+        CHECK(test::destructed == 0);
+    }
+    CHECK(test::destructed == 2);
+}
+
+// Output iterator whose assignment throws after `budget` handles, like a container failing to grow
+struct throwing_inserter {
+    using iterator_category = std::output_iterator_tag;
+    using value_type = void;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = void;
+
+    std::vector<intrusive_ptr<Plain>>* out;
+    int* budget; // shared by the copies out++ makes
+
+    throwing_inserter& operator=(intrusive_ptr<Plain>&& handle) {
+        if ((*budget)-- == 0) {
+            throw std::bad_alloc();
+        }
+        out->push_back(std::move(handle));
+        return *this;
+    }
+
+    throwing_inserter& operator*() {
+        return *this;
+    }
+
+    throwing_inserter& operator++() {
+        return *this;
+    }
+
+    throwing_inserter operator++(int) {
+        return *this;
+    }
+};
+
+// If writing a handle throws, the refs that weren't handed out yet are given back
+void test_share_n_throws() {
+    test::destructed = 0;
+    std::vector<intrusive_ptr<Plain>> shared;
+    {
+        auto plain = make_intrusive<Plain>();
+        int budget = 4;
+        bool threw = false;
+        try {
+            plain.share_n(10, throwing_inserter{&shared, &budget});
+        } catch (const std::bad_alloc&) {
+            threw = true;
+        }
+        CHECK(threw);
+        CHECK(shared.size() == 4);
+    }
+    CHECK(test::destructed == 0); // the 4 that made it out keep it alive
+    shared.clear();
+    CHECK(test::destructed == 1);
+}
+
+// Weak-free targets die on the release that takes strong to 0, whichever thread that is, exactly once
+void test_weak_free() {
+    test::destructed = 0;
+    {
+        auto unique = make_intrusive<WeakFree>();
+    }
+    CHECK(test::destructed == 1);
+
+    for (int round = 0; round < 50; ++round) {
+        auto shared = make_intrusive<WeakFree>();
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            std::vector<intrusive_ptr<WeakFree>> mine;
+            shared.share_n(2, std::back_inserter(mine));
+            threads.emplace_back([mine = std::move(mine)]() mutable {
+                for (int i = 0; i < 1000; ++i) {
+                    intrusive_ptr<WeakFree> copy = mine[0];
+                    CHECK(copy.get()->payload == 42);
+                }
+                mine[0] = intrusive_ptr<WeakFree>();
+                intrusive_ptr<WeakFree>::release_n(mine.begin(), mine.end());
+            });
+        }
+        shared = intrusive_ptr<WeakFree>(); // main may or may not be the last one out
+        for (auto& t : threads) {
+            t.join();
+        }
+        CHECK(test::destructed == round + 2);
+    }
+    CHECK(resources_released == 0); // no weak refs to outlive strong, so never called
+}
+
+int main() {
+    test_immortal();
+    test_not_immortal();
+    test_share_n_release_n();
+    test_release_n_mixed_targets();
+    test_share_n_throws();
+    test_weak_free();
+    std::cout << "refcount: all passed" << std::endl;
+}
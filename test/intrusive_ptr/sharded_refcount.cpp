@@ -0,0 +1,96 @@
+#include "../../c10/util/intrusive_ptr.h"
+#include "../test_utils.h"
+
+#include <atomic>
+#include <iostream>
+#include <iterator>
+#include <thread>
+#include <vector>
+
+using namespace c10::intrusive_ptr;
+
+struct Model : sharded_intrusive_ptr_target, test::counts_destruction {
+    int payload = 42;
+};
+
+// Before retire() the live bias keeps the target alive however the shards net out
+void test_not_retired_stays_alive() {
+    test::destructed = 0;
+    auto model = make_intrusive<Model>();
+    std::thread other([model_copy = model]() mutable {
+        intrusive_ptr<Model> moved = std::move(model_copy); // retained on main's shard, released on this one
+    });
+    other.join();
+    CHECK(test::destructed == 0);
+    model.get()->retire();
+    model = intrusive_ptr<Model>();
+    CHECK(test::destructed == 1);
+}
+
+void test_bulk_after_retire() {
+    test::destructed = 0;
+    {
+        auto model = make_intrusive<Model>();
+        std::vector<intrusive_ptr<Model>> copies;
+        model.share_n(8, std::back_inserter(copies)); // lands in a shard
+        model.get()->retire();
+        intrusive_ptr<Model>::release_n(copies.begin(), copies.end()); // goes to the central count
+        CHECK(test::destructed == 0);
+    }
+    CHECK(test::destructed == 1);
+}
+
+/**
+ * Threads keep taking and dropping refs (some kept across the retire) while one of them retires the
+ * target halfway through and everyone races it, repeated many times so the fold lands at different points.
+ * Whatever the interleaving the target has to be destroyed exactly once, after the last handle goes.
+ */
+void test_retire_races_retain_release() {
+    constexpr int kThreads = 8;
+    constexpr int kRounds = 200;
+    constexpr int kIterations = 500;
+    test::destructed = 0;
+    for (int round = 0; round < kRounds; ++round) {
+        std::atomic<bool> go{false};
+        std::atomic<int> payload_errors{0};
+        {
+            auto model = make_intrusive<Model>();
+            std::vector<std::thread> threads;
+            for (int t = 0; t < kThreads; ++t) {
+                threads.emplace_back([&, t] {
+                    while (!go.load()) {
+                        std::this_thread::yield();
+                    }
+                    std::vector<intrusive_ptr<Model>> kept;
+                    for (int i = 0; i < kIterations; ++i) {
+                        intrusive_ptr<Model> copy = model;
+                        if (copy.get()->payload != 42) {
+                            payload_errors++;
+                        }
+                        if (i % 5 == 0) {
+                            kept.push_back(std::move(copy));
+                        }
+                        if (i == kIterations / 2 && t % 2 == 0) {
+                            model.get()->retire(); // several threads race, only the first one folds
+                        }
+                    }
+                    // kept refs are dropped here, partly before and partly after other threads finish
+                });
+            }
+            go = true;
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            CHECK(test::destructed == round); // main still holds model
+        }
+        CHECK(test::destructed == round + 1);
+        CHECK(payload_errors == 0);
+    }
+}
+
+int main() {
+    test_not_retired_stays_alive();
+    test_bulk_after_retire();
+    test_retire_races_retain_release();
+    std::cout << "sharded_refcount: all passed" << std::endl;
+}
@@ -0,0 +1,185 @@
+// Run it both without and with -DC10_INTRUSIVE_PTR_METRICS, the live target gauge is only checked with it
+#include "../../c10/util/metrics.h"
+#include "../test_utils.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+using namespace c10;
+
+// The flag picks the inline namespace, so TUs built with a different setting can't share these types
+#ifdef C10_INTRUSIVE_PTR_METRICS
+static_assert(std::is_same_v<metrics::registry, metrics::with_metrics::registry>);
+static_assert(std::is_same_v<intrusive_ptr::intrusive_ptr_target, intrusive_ptr::with_metrics::intrusive_ptr_target>);
+#else
+static_assert(std::is_same_v<metrics::registry, metrics::without_metrics::registry>);
+static_assert(std::is_same_v<intrusive_ptr::intrusive_ptr_target, intrusive_ptr::without_metrics::intrusive_ptr_target>);
+#endif
+
+bool contains(const std::string& text, const std::string& line) {
+    return text.find(line + "\n") != std::string::npos;
+}
+
+// Value of the sample line starting with `name `, parsed back as a double
+double sample(const std::string& text, const std::string& name) {
+    size_t pos = text.find("\n" + name + " ");
+    CHECK(pos != std::string::npos);
+    return std::strtod(text.c_str() + pos + name.size() + 2, nullptr);
+}
+
+void test_prometheus_format() {
+    metrics::registry reg;
+    auto& hits = reg.add_counter("pool_hits_total", "Thread pool hits");
+    auto& depth = reg.add_gauge("queue_depth", "Queued batches");
+    auto& latency = reg.add_histogram("op_latency_seconds", "Op latency", {0.1, 1, 10});
+    reg.add_callback_gauge("answer", "Read at dump time", [] { return 42.0; });
+
+    CHECK(&reg.add_counter("pool_hits_total", "again") == &hits);
+    bool threw = false;
+    try {
+        reg.add_gauge("pool_hits_total", "wrong type");
+    } catch (const std::logic_error&) {
+        threw = true;
+    }
+    CHECK(threw);
+
+    // updates from several threads land in different cells, the dump sums them
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&] {
+            hits.inc(10);
+            depth.inc(3);
+            depth.dec();
+            latency.observe(0.05); // le 0.1
+            latency.observe(0.5);  // le 1
+            latency.observe(5);    // le 10
+            latency.observe(50);   // only +Inf
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    std::ostringstream out;
+    reg.write_prometheus(out);
+    std::string text = out.str();
+
+    CHECK(contains(text, "# HELP pool_hits_total Thread pool hits"));
+    CHECK(contains(text, "# TYPE pool_hits_total counter"));
+    CHECK(contains(text, "pool_hits_total 40"));
+
+    CHECK(contains(text, "# TYPE queue_depth gauge"));
+    CHECK(contains(text, "queue_depth 8"));
+
+    CHECK(contains(text, "# TYPE answer gauge"));
+    CHECK(contains(text, "answer 42"));
+
+    // buckets are cumulative and end with +Inf == _count
+    CHECK(contains(text, "# HELP op_latency_seconds Op latency"));
+    CHECK(contains(text, "# TYPE op_latency_seconds histogram"));
+    CHECK(contains(text, "op_latency_seconds_bucket{le=\"0.1\"} 4"));
+    CHECK(contains(text, "op_latency_seconds_bucket{le=\"1\"} 8"));
+    CHECK(contains(text, "op_latency_seconds_bucket{le=\"10\"} 12"));
+    CHECK(contains(text, "op_latency_seconds_bucket{le=\"+Inf\"} 16"));
+    CHECK(std::fabs(sample(text, "op_latency_seconds_sum") - 222.2) < 1e-9);
+    CHECK(contains(text, "op_latency_seconds_count 16"));
+
+    // HELP/TYPE come right before their samples
+    CHECK(text.find("# TYPE op_latency_seconds histogram\nop_latency_seconds_bucket") != std::string::npos);
+
+    std::string path = "metrics_test.prom";
+    CHECK(reg.dump_prometheus(path));
+    std::ifstream in(path);
+    std::stringstream dumped;
+    dumped << in.rdbuf();
+    CHECK(dumped.str() == text);
+    std::remove(path.c_str());
+}
+
+// Values are exact (integers) or round-trip (everything else), never the stream's 6 significant digits
+void test_value_format() {
+    metrics::registry reg;
+    reg.add_callback_gauge("big", "h", [] { return 12345678.0; });
+    reg.add_callback_gauge("third", "h", [] { return 1.0 / 3; });
+    reg.add_callback_gauge("negative", "h", [] { return -2.5; });
+    reg.add_callback_gauge("infinite", "h", [] { return std::numeric_limits<double>::infinity(); });
+    auto& close = reg.add_histogram("close_bounds", "h", {1234567, 1234568, 0.1});
+    close.observe(1);
+    std::ostringstream out;
+    reg.write_prometheus(out);
+    std::string text = out.str();
+
+    CHECK(contains(text, "big 12345678"));
+    CHECK(sample(text, "third") == 1.0 / 3);
+    CHECK(contains(text, "negative -2.5"));
+    CHECK(contains(text, "infinite +Inf"));
+    // close bounds keep distinct labels
+    CHECK(contains(text, "close_bounds_bucket{le=\"1234567\"} 1"));
+    CHECK(contains(text, "close_bounds_bucket{le=\"1234568\"} 1"));
+    CHECK(contains(text, "close_bounds_bucket{le=\"0.1\"} 1"));
+    CHECK(contains(text, "close_bounds_sum 1"));
+}
+
+// HELP is a single line, backslashes and newlines in it are escaped
+void test_help_escaping() {
+    metrics::registry reg;
+    reg.add_counter("escaped_total", "first line\nsecond \\ line");
+    std::ostringstream out;
+    reg.write_prometheus(out);
+    CHECK(contains(out.str(), "# HELP escaped_total first line\\nsecond \\\\ line\n# TYPE escaped_total counter"));
+}
+
+void test_histogram_bounds() {
+    bool threw = false;
+    try {
+        metrics::histogram too_many("h", "h", std::vector<double>(metrics::histogram::kMaxBounds + 1, 1.0));
+    } catch (const std::invalid_argument&) {
+        threw = true;
+    }
+    CHECK(threw);
+    metrics::histogram max_ok("h", "h", metrics::histogram::exponential_bounds(1e-6, 2, metrics::histogram::kMaxBounds));
+    max_ok.observe(1e9);
+}
+
+struct Target : intrusive_ptr::intrusive_ptr_target {};
+
+void test_live_targets() {
+#ifdef C10_INTRUSIVE_PTR_METRICS
+    auto live = [] {
+        std::ostringstream out;
+        metrics::registry::global().write_prometheus(out);
+        return out.str();
+    };
+    CHECK(contains(live(), "# TYPE c10_intrusive_ptr_live_targets gauge"));
+    CHECK(contains(live(), "c10_intrusive_ptr_live_targets 0"));
+    {
+        auto a = intrusive_ptr::make_intrusive<Target>();
+        auto b = intrusive_ptr::make_intrusive<Target>();
+        CHECK(contains(live(), "c10_intrusive_ptr_live_targets 2"));
+    }
+    CHECK(contains(live(), "c10_intrusive_ptr_live_targets 0"));
+#else
+    std::ostringstream out;
+    metrics::registry::global().write_prometheus(out);
+    CHECK(out.str().find("c10_intrusive_ptr_live_targets") == std::string::npos);
+#endif
+}
+
+int main() {
+    test_prometheus_format();
+    test_value_format();
+    test_help_escaping();
+    test_histogram_bounds();
+    test_live_targets();
+    std::cout << "metrics: all passed" << std::endl;
+}
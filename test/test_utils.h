@@ -0,0 +1,30 @@
+#pragma once
+
+// Each test file is its own main, build and run one from its directory with
+//   g++ -std=c++17 -pthread <test>.cpp && ./a.out
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << " check failed: " #cond << std::endl; \
+            std::exit(1); \
+        } \
+    } while (0)
+
+namespace test {
+
+// Number of counts_destruction objects destroyed so far, reset it at the start of a test
+inline std::atomic<int> destructed{0};
+
+// Mix into a test target so tests can check every target is destroyed exactly once
+struct counts_destruction {
+    ~counts_destruction() {
+        destructed++;
+    }
+};
+
+} // namespace test